@@ -8,7 +8,19 @@
 #include <sstream>
 #include <string>
 #include <algorithm>
+#include <climits>
+#include <map>
+#include <deque>
+#include <set>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <functional>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
 #include <grpc/grpc.h>
 #include <grpcpp/channel.h>
@@ -23,6 +35,7 @@ using grpc::ClientReader;
 using grpc::ClientReaderWriter;
 using grpc::ClientWriter;
 using grpc::Status;
+using grpc::StatusCode;
 
 using SimpleNetworkFilesystem::Path;
 using SimpleNetworkFilesystem::Stat;
@@ -53,23 +66,57 @@ using namespace std;
 class NFSClient {
     private:
     unique_ptr<NFS::Stub> stub;
+    int deadlineMs;
+
+    // Bound every RPC so a stalled server cannot hang the FUSE thread
+    void prepare( ClientContext& context ) {
+        if (deadlineMs > 0) {
+            context.set_deadline(chrono::system_clock::now() + chrono::milliseconds(deadlineMs));
+        }
+    }
+
+    // Transport failures become errnos that the server never reports for
+    // these calls, so callers can tell a failed RPC from a real answer
+    static int rpcError( const Status& status ) {
+        switch (status.error_code()) {
+            case StatusCode::DEADLINE_EXCEEDED:
+                return -ETIMEDOUT;
+            case StatusCode::UNAVAILABLE:
+                return -ENOTCONN;
+            case StatusCode::CANCELLED:
+                return -ECANCELED;
+            default:
+                return -ECOMM;
+        }
+    }
 
     public:
-    NFSClient(shared_ptr<Channel> channel) : stub(NFS::NewStub(channel)) {}
+    static bool isTransportError( int status ) {
+        return status == -ETIMEDOUT || status == -ENOTCONN ||
+               status == -ECANCELED || status == -ECOMM;
+    }
 
-    int getAttr( const string& path, Stat* stat ) {
-        ClientContext context;
+    NFSClient(shared_ptr<Channel> channel, int deadlineMs = 0)
+        : stub(NFS::NewStub(channel)), deadlineMs(deadlineMs) {}
+
+    int getAttr( const string& path, Stat* stat, ClientContext* callerContext = nullptr ) {
+        // A caller-owned context lets a hedging caller cancel the call
+        ClientContext ownContext;
+        ClientContext& context = callerContext ? *callerContext : ownContext;
+        prepare(context);
         Path pathMessage;
         pathMessage.set_path(path);
         Status status = stub->getattr(&context, pathMessage, stat);
         if (!status.ok()) {
-            return -status.error_code();
+            return rpcError(status);
         }
         return -stat->err();
     }
 
-    int readdir( const string& path, vector<Dirent>& entries ) {
-        ClientContext context;
+    int readdir( const string& path, vector<Dirent>& entries, ClientContext* callerContext = nullptr ) {
+        ClientContext ownContext;
+        ClientContext& context = callerContext ? *callerContext : ownContext;
+        prepare(context);
         Path pathMessage;
         pathMessage.set_path(path);
         unique_ptr<ClientReader<Dirent>> reader(stub->readdir(&context, pathMessage));
@@ -83,39 +130,48 @@ class NFSClient {
         }
         Status status = reader->Finish();
         if (!status.ok()) {
-            return -status.error_code();
+            return rpcError(status);
+        }
+        if (entry.err() != 0) {
+            return -entry.err();
+        }
+        // Drop the trailing sentinel that carried err == 0
+        if (!entries.empty()) {
+            entries.pop_back();
         }
-        entries.pop_back();
-        return -entry.err();
+        return 0;
     }
 
     int rmdir( const string& path ) {
         ClientContext context;
+        prepare(context);
         Path pathMessage;
         pathMessage.set_path(path);
         ErrnoReply response;
         Status status = stub->rmdir(&context, pathMessage, &response);
         if (!status.ok()) {
-            return -status.error_code();
+            return rpcError(status);
         }
         return -response.err();
     }
 
     int mkdir( const string& path, uint32_t mode ) {
         ClientContext context;
+        prepare(context);
         MkdirRequest request;
         request.set_path(path);
         request.set_mode(mode);
         ErrnoReply response;
         Status status = stub->mkdir(&context, request, &response);
         if (!status.ok()) {
-            return -status.error_code();
+            return rpcError(status);
         }
         return -response.err();
     }
 
     int create( const string& path, uint32_t mode, int32_t flags, uint64_t& fh ) {
         ClientContext context;
+        prepare(context);
         CreateRequest request;
         request.set_path(path);
         request.set_mode(mode);
@@ -123,7 +179,7 @@ class NFSClient {
         FuseFileInfo response;
         Status status = stub->create(&context, request, &response);
         if (!status.ok()) {
-            return -status.error_code();
+            return rpcError(status);
         }
         if (response.err() != 0) {
             return -response.err();
@@ -137,21 +193,25 @@ class NFSClient {
 
     }
 
-    int open( const string& path, int32_t flags, uint64_t& fileHandle ) {
-        ClientContext context;
+    int open( const string& path, int32_t flags, uint64_t& fileHandle, ClientContext* callerContext = nullptr ) {
+        ClientContext ownContext;
+        ClientContext& context = callerContext ? *callerContext : ownContext;
+        prepare(context);
         FuseFileInfo request, response;
         request.set_path(path);
         request.set_flags(flags);
         Status status = stub->open(&context, request, &response);
         if (!status.ok()) {
-            return -status.error_code();
+            return rpcError(status);
         }
         fileHandle = response.fh();
         return -response.err();
     }
 
-    int read( uint64_t fh, uint64_t count, int64_t offset, string& buf ) {
-        ClientContext context;
+    int read( uint64_t fh, uint64_t count, int64_t offset, string& buf, ClientContext* callerContext = nullptr ) {
+        ClientContext ownContext;
+        ClientContext& context = callerContext ? *callerContext : ownContext;
+        prepare(context);
         ReadRequest request;
         request.set_fh(fh);
         request.set_count(count);
@@ -159,7 +219,7 @@ class NFSClient {
         ReadReply response;
         Status status = stub->read(&context, request, &response);
         if (!status.ok()) {
-            return -status.error_code();
+            return rpcError(status);
         }
         if (response.err() != 0) {
             return -response.err();
@@ -171,6 +231,7 @@ class NFSClient {
 
     int write( uint64_t fh, const string& writeBuf, uint32_t count, int64_t offset ) {
         ClientContext context;
+        prepare(context);
         WriteRequest request;
         request.set_fh(fh);
         request.set_buffer(writeBuf);
@@ -179,7 +240,7 @@ class NFSClient {
         WriteReply response;
         Status status = stub->write(&context, request, &response);
         if (!status.ok()) {
-            return -status.error_code();
+            return rpcError(status);
         }
         if (response.err() != 0) {
             return -response.err();
@@ -190,32 +251,36 @@ class NFSClient {
 
     int unlink( const string& path ) {
         ClientContext context;
+        prepare(context);
         Path request;
         request.set_path(path);
         ErrnoReply response;
         Status status = stub->unlink(&context, request, &response);
         if (!status.ok()) {
-            return -status.error_code();
+            return rpcError(status);
         }
         return -response.err();
     }
 
     int rename( const string& oldName, const string& newName ) {
         ClientContext context;
+        prepare(context);
         RenameRequest request;
         request.set_from_path(oldName);
         request.set_to_path(newName);
         ErrnoReply response;
         Status status = stub->rename(&context, request, &response);
         if (!status.ok()) {
-            return -status.error_code();
+            return rpcError(status);
         }
         return -response.err();
     }
 
     int utimens( const string& path, uint64_t accessedSec, uint64_t accessedNano, uint64_t modifiedSec, uint64_t modifiedNano ) {
         ClientContext context;
+        prepare(context);
         UtimensRequest request;
+        request.set_path(path);
         request.set_access_sec(accessedSec);
         request.set_access_nsec(accessedNano);
         request.set_modify_sec(modifiedSec);
@@ -223,37 +288,972 @@ class NFSClient {
         ErrnoReply response;
         Status status = stub->utimens(&context, request, &response);
         if (!status.ok()) {
-            return -status.error_code();
+            return rpcError(status);
         }
         return -response.err();
     }
 
     int commitWrite( uint64_t fh ) {
         ClientContext context;
+        prepare(context);
         CommitRequest request;
         request.set_fh(fh);
         CommitReply response;
         Status status = stub->commitWrite(&context, request, &response);
         if (!status.ok()) {
-            return -status.error_code();
+            return rpcError(status);
         }
         return -response.err();
     }
 
     int release( uint64_t fh ) {
         ClientContext context;
+        prepare(context);
         ReleaseRequest request;
         request.set_fh(fh);
         ErrnoReply response;
         Status status = stub->release(&context, request, &response);
         if (!status.ok()) {
-            return -status.error_code();
+            return rpcError(status);
         }
         return -response.err();
     }
 };
 
-shared_ptr<NFSClient> nfsClient;
+/*=======================================================
+
+    Replica sets with hedged reads
+
+=========================================================*/
+
+// Fixed set of threads that run hedged attempts and mirror opens, so the
+// read path does not create a thread per RPC. Destroying the pool joins its
+// threads; the tasks it runs are bounded by the RPC deadline.
+class WorkerPool {
+    private:
+    mutex m;
+    condition_variable cv;
+    deque<function<void()>> tasks;
+    vector<thread> threads;
+    bool stopping = false;
+
+    void run() {
+        while (true) {
+            function<void()> task;
+            {
+                unique_lock<mutex> lock(m);
+                cv.wait(lock, [this]() { return stopping || !tasks.empty(); });
+                if (tasks.empty()) {
+                    return;
+                }
+                task = move(tasks.front());
+                tasks.pop_front();
+            }
+            task();
+        }
+    }
+
+    public:
+    explicit WorkerPool( size_t size ) {
+        for (size_t i = 0; i < size; ++i) {
+            threads.push_back(thread(&WorkerPool::run, this));
+        }
+    }
+
+    ~WorkerPool() {
+        {
+            lock_guard<mutex> lock(m);
+            stopping = true;
+        }
+        cv.notify_all();
+        for (auto it = threads.begin(); it != threads.end(); ++it) {
+            it->join();
+        }
+    }
+
+    void submit( function<void()> task ) {
+        {
+            lock_guard<mutex> lock(m);
+            tasks.push_back(move(task));
+        }
+        cv.notify_one();
+    }
+};
+
+// One shard: a primary plus optional replicas exporting the same tree.
+// Writes and namespace changes go to the primary. getattr, readdir and read
+// go to the replica with the lowest latency EWMA; if it has not answered
+// within the p95 latency observed for that operation, a hedged duplicate
+// goes to the next best replica, the first answer wins and the loser is
+// cancelled. A replica whose RPC fails is tried last for a while. Idempotent
+// operations are retried with exponential backoff on timeouts and
+// unreachable servers.
+class ReplicaSet {
+    private:
+    enum TimedOp { OpGetattr, OpReaddir, OpRead, OpCount };
+
+    static const size_t windowSize = 256;
+    static const size_t minSamples = 20;
+    static const int defaultHedgeUs = 10000;
+    static const int minHedgeUs = 500;
+    static const int maxRetries = 3;
+    static const int backoffMs = 10;
+    static const int downMs = 1000;
+    static const size_t workersPerMember = 4;
+    static const uint64_t noHandle = ~0ULL;
+
+    struct LatencyWindow {
+        vector<double> samples;
+        size_t next = 0;
+
+        void add( double us ) {
+            if (samples.size() < windowSize) {
+                samples.push_back(us);
+            } else {
+                samples[next] = us;
+                next = (next + 1) % windowSize;
+            }
+        }
+
+        double percentile95() const {
+            if (samples.size() < minSamples) {
+                return -1;
+            }
+            vector<double> sorted(samples);
+            size_t k = sorted.size() * 95 / 100;
+            nth_element(sorted.begin(), sorted.begin() + k, sorted.end());
+            return sorted[k];
+        }
+    };
+
+    // Shared with tasks still running on the pool
+    struct Stats {
+        mutex m;
+        vector<double> ewmaUs;
+        vector<bool> sampled;
+        vector<chrono::steady_clock::time_point> downUntil;
+        LatencyWindow windows[OpCount];
+
+        explicit Stats( size_t members )
+            : ewmaUs(members, 0), sampled(members, false), downUntil(members) {}
+
+        void record( size_t member, int status, chrono::steady_clock::time_point start ) {
+            record(OpCount, member, status, start);
+        }
+
+        void record( TimedOp op, size_t member, int status, chrono::steady_clock::time_point start ) {
+            auto now = chrono::steady_clock::now();
+            lock_guard<mutex> lock(m);
+            if (status == -ECANCELED) {
+                // We cancelled it because another replica answered first, so
+                // its elapsed time is only a lower bound on its latency.
+                // Counting that bound still stops a replica that never
+                // answers from being tried first forever.
+                double us = chrono::duration<double, micro>(now - start).count();
+                ewmaUs[member] = sampled[member] ? max(ewmaUs[member], us) : us;
+                sampled[member] = true;
+                return;
+            }
+            if (NFSClient::isTransportError(status)) {
+                // A failed RPC is not a latency sample: a dead replica fails
+                // fast and a stalled one takes the whole deadline. Push the
+                // member to the back of the order instead.
+                downUntil[member] = now + chrono::milliseconds(downMs);
+                return;
+            }
+            double us = chrono::duration<double, micro>(now - start).count();
+            ewmaUs[member] = sampled[member] ? 0.8 * ewmaUs[member] + 0.2 * us : us;
+            sampled[member] = true;
+            if (op != OpCount) {
+                windows[op].add(us);
+            }
+        }
+    };
+
+    template <typename Reply>
+    struct HedgeState {
+        mutex m;
+        condition_variable cv;
+        int pending = 0;
+        bool done = false;
+        int result = -ECOMM;
+        Reply reply;
+        vector<shared_ptr<ClientContext>> contexts;
+    };
+
+    // With replicas, a handle indexes per-member fds; otherwise it is the
+    // primary's fd as is. Replica fds of a read-only open are filled in by
+    // pool tasks as they arrive.
+    struct HandleTable {
+        mutex m;
+        map<uint64_t, vector<uint64_t>> handles;
+        uint64_t nextHandle = 0;
+    };
+
+    struct MirrorState {
+        mutex m;
+        bool failed = false;
+        uint64_t handle = noHandle;
+        vector<uint64_t> early;
+    };
+
+    vector<shared_ptr<NFSClient>> members;
+    shared_ptr<Stats> stats;
+    shared_ptr<HandleTable> table;
+    // Declared last so it is destroyed, and its threads joined, first
+    unique_ptr<WorkerPool> pool;
+
+    static bool isRetryable( int status ) {
+        return status == -ETIMEDOUT || status == -ENOTCONN;
+    }
+
+    NFSClient& primary() {
+        return *members[0];
+    }
+
+    int retrying( const function<int()>& attempt ) {
+        int status = attempt();
+        for (int i = 0; i < maxRetries && isRetryable(status); ++i) {
+            this_thread::sleep_for(chrono::milliseconds(backoffMs << i));
+            status = attempt();
+        }
+        return status;
+    }
+
+    // Candidates ordered by observed latency. Members that recently failed
+    // go last; unmeasured ones go first so that every replica gets an EWMA.
+    vector<size_t> byLatency( const vector<size_t>& candidates ) {
+        auto now = chrono::steady_clock::now();
+        lock_guard<mutex> lock(stats->m);
+        vector<size_t> order(candidates);
+        Stats& s = *stats;
+        stable_sort(order.begin(), order.end(), [&s, now](size_t a, size_t b) {
+            bool downA = s.downUntil[a] > now, downB = s.downUntil[b] > now;
+            if (downA != downB) {
+                return downB;
+            }
+            if (s.sampled[a] != s.sampled[b]) {
+                return !s.sampled[a];
+            }
+            return s.ewmaUs[a] < s.ewmaUs[b];
+        });
+        return order;
+    }
+
+    chrono::microseconds hedgeDelay( TimedOp op ) {
+        lock_guard<mutex> lock(stats->m);
+        double p95 = stats->windows[op].percentile95();
+        if (p95 < 0) {
+            return chrono::microseconds(defaultHedgeUs);
+        }
+        return chrono::microseconds(max(static_cast<int64_t>(p95), static_cast<int64_t>(minHedgeUs)));
+    }
+
+    template <typename Reply>
+    int hedged( TimedOp op, const vector<size_t>& candidates,
+                const function<int(size_t, NFSClient&, Reply&, ClientContext*)>& call, Reply& out ) {
+        vector<size_t> order = byLatency(candidates);
+        if (order.size() == 1) {
+            auto start = chrono::steady_clock::now();
+            int status = call(order[0], *members[order[0]], out, nullptr);
+            stats->record(op, order[0], status, start);
+            return status;
+        }
+
+        // Attempts run on the pool with a context we own, so the caller can
+        // stop waiting and cancel whatever is still in flight
+        shared_ptr<HedgeState<Reply>> state = make_shared<HedgeState<Reply>>();
+        shared_ptr<Stats> sharedStats = stats;
+        size_t next = 0;
+        auto launch = [&]() {
+            size_t member = order[next++];
+            shared_ptr<NFSClient> client = members[member];
+            shared_ptr<ClientContext> context = make_shared<ClientContext>();
+            state->contexts.push_back(context);
+            state->pending++;
+            pool->submit([state, sharedStats, client, context, call, op, member]() {
+                Reply reply;
+                auto start = chrono::steady_clock::now();
+                int status = call(member, *client, reply, context.get());
+                sharedStats->record(op, member, status, start);
+                lock_guard<mutex> lock(state->m);
+                state->pending--;
+                if (!state->done) {
+                    state->result = status;
+                    // Only an answer from a server wins; any failed RPC
+                    // fails over to the next replica
+                    if (!NFSClient::isTransportError(status)) {
+                        state->done = true;
+                        state->reply = move(reply);
+                    }
+                }
+                state->cv.notify_all();
+            });
+        };
+
+        unique_lock<mutex> lock(state->m);
+        launch();
+        bool hedgeSent = false;
+        auto settled = [&]() { return state->done || state->pending == 0; };
+        while (!state->done) {
+            if (state->pending == 0) {
+                if (next == order.size()) {
+                    break;
+                }
+                launch();
+            } else if (!hedgeSent && next < order.size()) {
+                if (!state->cv.wait_for(lock, hedgeDelay(op), settled)) {
+                    launch();
+                    hedgeSent = true;
+                }
+            } else {
+                state->cv.wait(lock, settled);
+            }
+        }
+        for (auto it = state->contexts.begin(); it != state->contexts.end(); ++it) {
+            (*it)->TryCancel();
+        }
+        if (state->done) {
+            out = move(state->reply);
+        }
+        return state->result;
+    }
+
+    vector<size_t> allMembers() const {
+        vector<size_t> all;
+        for (size_t i = 0; i < members.size(); ++i) {
+            all.push_back(i);
+        }
+        return all;
+    }
+
+    // Opens a read-only file on every replica in parallel with the primary
+    // and returns as soon as the primary answers. Replica fds join the
+    // handle as they arrive; one that arrives after the primary failed or
+    // the handle was released is closed again.
+    int mirrorOpen( const string& path, int32_t flags, uint64_t& fileHandle ) {
+        shared_ptr<MirrorState> state = make_shared<MirrorState>();
+        state->early.assign(members.size(), noHandle);
+        shared_ptr<HandleTable> sharedTable = table;
+        shared_ptr<Stats> sharedStats = stats;
+        for (size_t i = 1; i < members.size(); ++i) {
+            shared_ptr<NFSClient> client = members[i];
+            pool->submit([state, sharedTable, sharedStats, client, path, flags, i]() {
+                uint64_t fd;
+                auto start = chrono::steady_clock::now();
+                int status = client->open(path, flags, fd);
+                sharedStats->record(i, status, start);
+                if (status != 0) {
+                    return;
+                }
+                bool orphaned = false;
+                {
+                    lock_guard<mutex> lock(state->m);
+                    if (state->failed) {
+                        orphaned = true;
+                    } else if (state->handle == noHandle) {
+                        state->early[i] = fd;
+                    } else {
+                        lock_guard<mutex> tableLock(sharedTable->m);
+                        auto it = sharedTable->handles.find(state->handle);
+                        if (it == sharedTable->handles.end()) {
+                            orphaned = true;
+                        } else {
+                            it->second[i] = fd;
+                        }
+                    }
+                }
+                if (orphaned) {
+                    client->release(fd);
+                }
+            });
+        }
+
+        uint64_t fd;
+        auto start = chrono::steady_clock::now();
+        int status = primary().open(path, flags, fd);
+        stats->record(0, status, start);
+
+        vector<uint64_t> stranded;
+        {
+            lock_guard<mutex> lock(state->m);
+            if (status == 0) {
+                state->early[0] = fd;
+                fileHandle = addHandle(state->early);
+                state->handle = fileHandle;
+            } else {
+                state->failed = true;
+                stranded = state->early;
+            }
+        }
+        for (size_t i = 1; i < stranded.size(); ++i) {
+            if (stranded[i] != noHandle) {
+                members[i]->release(stranded[i]);
+            }
+        }
+        return status;
+    }
+
+    uint64_t addHandle( const vector<uint64_t>& fds ) {
+        lock_guard<mutex> lock(table->m);
+        uint64_t handle = table->nextHandle++;
+        table->handles[handle] = fds;
+        return handle;
+    }
+
+    vector<uint64_t> lookupHandle( uint64_t handle ) {
+        lock_guard<mutex> lock(table->m);
+        auto it = table->handles.find(handle);
+        if (it == table->handles.end()) {
+            return vector<uint64_t>();
+        }
+        return it->second;
+    }
+
+    uint64_t primaryFd( uint64_t handle ) {
+        if (members.size() == 1) {
+            return handle;
+        }
+        vector<uint64_t> fds = lookupHandle(handle);
+        return fds.empty() ? noHandle : fds[0];
+    }
+
+    public:
+    ReplicaSet( const vector<string>& endpoints, int deadlineMs )
+        : stats(make_shared<Stats>(endpoints.size())), table(make_shared<HandleTable>()) {
+        for (size_t i = 0; i < endpoints.size(); ++i) {
+            shared_ptr<Channel> channel = grpc::CreateChannel(endpoints[i], grpc::InsecureChannelCredentials());
+            members.push_back(make_shared<NFSClient>(channel, deadlineMs));
+        }
+        if (members.size() > 1) {
+            pool.reset(new WorkerPool(workersPerMember * members.size()));
+        }
+    }
+
+    int getAttr( const string& path, Stat* stat ) {
+        vector<size_t> candidates = allMembers();
+        function<int(size_t, NFSClient&, Stat&, ClientContext*)> call =
+            [path](size_t, NFSClient& client, Stat& reply, ClientContext* context) {
+                return client.getAttr(path, &reply, context);
+            };
+        return retrying([&]() { return hedged(OpGetattr, candidates, call, *stat); });
+    }
+
+    int readdir( const string& path, vector<Dirent>& entries ) {
+        vector<size_t> candidates = allMembers();
+        function<int(size_t, NFSClient&, vector<Dirent>&, ClientContext*)> call =
+            [path](size_t, NFSClient& client, vector<Dirent>& reply, ClientContext* context) {
+                return client.readdir(path, reply, context);
+            };
+        // Each attempt fills its own vector, so a retry never duplicates entries
+        vector<Dirent> result;
+        int status = retrying([&]() {
+            result.clear();
+            return hedged(OpReaddir, candidates, call, result);
+        });
+        entries.insert(entries.end(), result.begin(), result.end());
+        return status;
+    }
+
+    int rmdir( const string& path ) {
+        return primary().rmdir(path);
+    }
+
+    int mkdir( const string& path, uint32_t mode ) {
+        return primary().mkdir(path, mode);
+    }
+
+    int create( const string& path, uint32_t mode, int32_t flags, uint64_t& fh ) {
+        int status = primary().create(path, mode, flags, fh);
+        if (status == 0 && members.size() > 1) {
+            vector<uint64_t> fds(members.size(), noHandle);
+            fds[0] = fh;
+            fh = addHandle(fds);
+        }
+        return status;
+    }
+
+    int open( const string& path, int32_t flags, uint64_t& fileHandle ) {
+        if (members.size() == 1) {
+            return primary().open(path, flags, fileHandle);
+        }
+        // Only read-only opens are mirrored, since only reads are hedged
+        if ((flags & O_ACCMODE) == O_RDONLY) {
+            return mirrorOpen(path, flags, fileHandle);
+        }
+        vector<uint64_t> fds(members.size(), noHandle);
+        int status = primary().open(path, flags, fds[0]);
+        if (status == 0) {
+            fileHandle = addHandle(fds);
+        }
+        return status;
+    }
+
+    int read( uint64_t fh, uint64_t count, int64_t offset, string& buf ) {
+        vector<uint64_t> fds;
+        vector<size_t> candidates;
+        if (members.size() == 1) {
+            fds.push_back(fh);
+            candidates.push_back(0);
+        } else {
+            fds = lookupHandle(fh);
+            for (size_t i = 0; i < fds.size(); ++i) {
+                if (fds[i] != noHandle) {
+                    candidates.push_back(i);
+                }
+            }
+            if (candidates.empty()) {
+                return -EBADF;
+            }
+        }
+        function<int(size_t, NFSClient&, string&, ClientContext*)> call =
+            [fds, count, offset](size_t member, NFSClient& client, string& reply, ClientContext* context) {
+                return client.read(fds[member], count, offset, reply, context);
+            };
+        return retrying([&]() { return hedged(OpRead, candidates, call, buf); });
+    }
+
+    int write( uint64_t fh, const string& writeBuf, uint32_t count, int64_t offset ) {
+        uint64_t fd = primaryFd(fh);
+        if (fd == noHandle) {
+            return -EBADF;
+        }
+        return retrying([&]() { return primary().write(fd, writeBuf, count, offset); });
+    }
+
+    int unlink( const string& path ) {
+        return primary().unlink(path);
+    }
+
+    int rename( const string& oldName, const string& newName ) {
+        return primary().rename(oldName, newName);
+    }
+
+    int utimens( const string& path, uint64_t accessedSec, uint64_t accessedNano, uint64_t modifiedSec, uint64_t modifiedNano ) {
+        return retrying([&]() {
+            return primary().utimens(path, accessedSec, accessedNano, modifiedSec, modifiedNano);
+        });
+    }
+
+    int commitWrite( uint64_t fh ) {
+        uint64_t fd = primaryFd(fh);
+        if (fd == noHandle) {
+            return -EBADF;
+        }
+        return retrying([&]() { return primary().commitWrite(fd); });
+    }
+
+    int release( uint64_t fh ) {
+        if (members.size() == 1) {
+            return primary().release(fh);
+        }
+        vector<uint64_t> fds;
+        {
+            lock_guard<mutex> lock(table->m);
+            auto it = table->handles.find(fh);
+            if (it == table->handles.end()) {
+                return -EBADF;
+            }
+            fds = it->second;
+            table->handles.erase(it);
+        }
+        for (size_t i = 1; i < fds.size(); ++i) {
+            if (fds[i] != noHandle) {
+                members[i]->release(fds[i]);
+            }
+        }
+        return primary().release(fds[0]);
+    }
+};
+
+const int ReplicaSet::defaultHedgeUs;
+const int ReplicaSet::downMs;
+const uint64_t ReplicaSet::noHandle;
+
+/*=======================================================
+
+    Namespace sharding across several servers
+
+=========================================================*/
+
+// Routes every operation to one of several NFSServer processes. A path is
+// owned by the shard found either in the subtree mount table (longest
+// matching prefix wins) or, failing that, by a consistent hash of its parent
+// directory, so all entries of one directory live on the same server.
+// Directories outside the mount table are created on every shard so that any
+// shard can hold their children. File handles carry the shard index in their
+// top bits so fh-based operations need no extra lookup. Each shard is a
+// ReplicaSet.
+class ShardedNFSClient {
+    private:
+    static const int shardShift = 48;
+    static const int virtualNodes = 64;
+    static const uint32_t copyChunk = 64 * 1024;
+
+    vector<shared_ptr<ReplicaSet>> shards;
+    map<uint32_t, size_t> ring;
+    map<string, size_t> mountTable;
+
+    static uint32_t hashPath( const string& key ) {
+        // FNV-1a, stable across builds and runs
+        uint32_t h = 2166136261u;
+        for (unsigned char ch : key) {
+            h ^= ch;
+            h *= 16777619u;
+        }
+        return h;
+    }
+
+    static string parentOf( const string& path ) {
+        size_t slash = path.find_last_of('/');
+        if (slash == string::npos || slash == 0) {
+            return "/";
+        }
+        return path.substr(0, slash);
+    }
+
+    // Returns true and sets shard if path lies inside a mounted subtree
+    bool lookupMount( const string& path, size_t& shard ) const {
+        size_t bestLength = 0;
+        bool found = false;
+        for (auto it = mountTable.begin(); it != mountTable.end(); ++it) {
+            const string& prefix = it->first;
+            if (path.compare(0, prefix.size(), prefix) == 0 &&
+                (path.size() == prefix.size() || path[prefix.size()] == '/') &&
+                prefix.size() >= bestLength) {
+                bestLength = prefix.size();
+                shard = it->second;
+                found = true;
+            }
+        }
+        return found;
+    }
+
+    size_t hashShard( const string& dir ) const {
+        auto it = ring.lower_bound(hashPath(dir));
+        if (it == ring.end()) {
+            it = ring.begin();
+        }
+        return it->second;
+    }
+
+    size_t shardFor( const string& path ) const {
+        size_t shard;
+        if (lookupMount(path, shard)) {
+            return shard;
+        }
+        return hashShard(parentOf(path));
+    }
+
+    // The shard holding the children of directory path
+    size_t childShardFor( const string& path ) const {
+        size_t shard;
+        if (lookupMount(path, shard)) {
+            return shard;
+        }
+        return hashShard(path);
+    }
+
+    uint64_t encodeHandle( size_t shard, uint64_t fh ) const {
+        return (static_cast<uint64_t>(shard) << shardShift) | fh;
+    }
+
+    ReplicaSet& shardOf( uint64_t fh ) const {
+        return *shards[fh >> shardShift];
+    }
+
+    static uint64_t localHandle( uint64_t fh ) {
+        return fh & ((1ULL << shardShift) - 1);
+    }
+
+    // Directories that may hold a copy of path: its mount shard, or every
+    // shard for a hashed directory
+    vector<size_t> holdersOf( const string& path ) const {
+        vector<size_t> holders;
+        size_t shard;
+        if (lookupMount(path, shard)) {
+            holders.push_back(shard);
+        } else {
+            for (size_t i = 0; i < shards.size(); ++i) {
+                holders.push_back(i);
+            }
+        }
+        return holders;
+    }
+
+    // Shards with a mount point directly under directory path; those hold
+    // entries of path that its own shard never sees
+    set<size_t> childMountShards( const string& path ) const {
+        set<size_t> result;
+        for (auto it = mountTable.begin(); it != mountTable.end(); ++it) {
+            if (parentOf(it->first) == path) {
+                result.insert(it->second);
+            }
+        }
+        return result;
+    }
+
+    static string siblingTemp( const string& path ) {
+        static unsigned long counter = 0;
+        string parent = parentOf(path);
+        string name = path.substr(path.find_last_of('/') + 1);
+        return (parent == "/" ? "/" : parent + "/") + "." + name + ".snfs-tmp." +
+               to_string(getpid()) + "." + to_string(__sync_fetch_and_add(&counter, 1));
+    }
+
+    int writeFully( ReplicaSet& shard, uint64_t fh, const string& buf, int64_t offset ) {
+        size_t done = 0;
+        while (done < buf.size()) {
+            int bytesWritten = shard.write(fh, buf.substr(done), buf.size() - done, offset + done);
+            if (bytesWritten < 0) {
+                return bytesWritten;
+            }
+            if (bytesWritten == 0) {
+                return -EIO;
+            }
+            done += bytesWritten;
+        }
+        return 0;
+    }
+
+    // Copies into a temporary sibling of newName on the target shard and
+    // renames it into place there, so newName is replaced atomically and a
+    // failure only ever removes the temporary file
+    int copyAcross( const string& oldName, size_t from, const string& newName, size_t to ) {
+        string tempName = siblingTemp(newName);
+        if (shardFor(tempName) != to) {
+            // newName is itself a mount point; there is no sibling on its shard
+            return -EXDEV;
+        }
+        Stat stat;
+        int status = shards[from]->getAttr(oldName, &stat);
+        if (status != 0) {
+            return status;
+        }
+        uint64_t src, dst;
+        status = shards[from]->open(oldName, O_RDONLY, src);
+        if (status != 0) {
+            return status;
+        }
+        status = shards[to]->create(tempName, stat.mode() & 07777, O_WRONLY | O_CREAT | O_EXCL, dst);
+        if (status != 0) {
+            shards[from]->release(src);
+            return status;
+        }
+        int64_t offset = 0;
+        string buf;
+        while (true) {
+            int bytesRead = shards[from]->read(src, copyChunk, offset, buf);
+            if (bytesRead <= 0) {
+                status = bytesRead;
+                break;
+            }
+            buf.resize(bytesRead);
+            status = writeFully(*shards[to], dst, buf, offset);
+            if (status != 0) {
+                break;
+            }
+            offset += bytesRead;
+        }
+        if (status == 0) {
+            status = shards[to]->commitWrite(dst);
+        }
+        shards[from]->release(src);
+        shards[to]->release(dst);
+        if (status == 0) {
+            status = shards[to]->rename(tempName, newName);
+        }
+        if (status != 0) {
+            // Source and destination are untouched; drop the partial copy
+            shards[to]->unlink(tempName);
+            return status;
+        }
+        return shards[from]->unlink(oldName);
+    }
+
+    public:
+    ShardedNFSClient( const vector<string>& endpoints, const map<size_t, vector<string>>& replicas,
+                      const map<string, size_t>& mounts, int deadlineMs )
+        : mountTable(mounts) {
+        for (size_t i = 0; i < endpoints.size(); ++i) {
+            vector<string> members(1, endpoints[i]);
+            auto it = replicas.find(i);
+            if (it != replicas.end()) {
+                members.insert(members.end(), it->second.begin(), it->second.end());
+            }
+            shards.push_back(make_shared<ReplicaSet>(members, deadlineMs));
+            // Virtual nodes are keyed by shard index, not address, so
+            // placement only depends on position in the shard list. That
+            // list is fixed for the life of the data: nothing is migrated,
+            // so adding or removing a server strands files on the shard
+            // their directory used to hash to
+            for (int v = 0; v < virtualNodes; ++v) {
+                ring[hashPath(to_string(i) + "#" + to_string(v))] = i;
+            }
+        }
+    }
+
+    int getAttr( const string& path, Stat* stat ) {
+        return shards[shardFor(path)]->getAttr(path, stat);
+    }
+
+    int readdir( const string& path, vector<Dirent>& entries ) {
+        set<size_t> sources = childMountShards(path);
+        size_t owner = childShardFor(path);
+        if (sources.empty() || (sources.size() == 1 && *sources.begin() == owner)) {
+            return shards[owner]->readdir(path, entries);
+        }
+        // Mount points directly under path live on their own shards, so
+        // merge those listings into the owner's
+        sources.insert(owner);
+        set<string> seen;
+        for (auto shard = sources.begin(); shard != sources.end(); ++shard) {
+            vector<Dirent> shardEntries;
+            int status = shards[*shard]->readdir(path, shardEntries);
+            if (status != 0) {
+                return status;
+            }
+            for (auto it = shardEntries.begin(); it != shardEntries.end(); ++it) {
+                if (seen.insert(it->name()).second) {
+                    entries.push_back(*it);
+                }
+            }
+        }
+        return 0;
+    }
+
+    int rmdir( const string& path ) {
+        vector<size_t> holders = holdersOf(path);
+        set<size_t> checked(holders.begin(), holders.end());
+        set<size_t> mounts = childMountShards(path);
+        checked.insert(mounts.begin(), mounts.end());
+        // Check every copy for emptiness first, so a refusal never leaves
+        // the directory removed from only some shards
+        for (auto shard = checked.begin(); shard != checked.end(); ++shard) {
+            vector<Dirent> shardEntries;
+            int status = shards[*shard]->readdir(path, shardEntries);
+            if (status == -ENOENT && mounts.count(*shard) == 0) {
+                continue;
+            }
+            if (status != 0) {
+                return status;
+            }
+            for (auto it = shardEntries.begin(); it != shardEntries.end(); ++it) {
+                if (it->name() != "." && it->name() != "..") {
+                    return -ENOTEMPTY;
+                }
+            }
+        }
+        size_t owner = childShardFor(path);
+        int status = shards[owner]->rmdir(path);
+        if (status != 0) {
+            return status;
+        }
+        for (auto shard = holders.begin(); shard != holders.end(); ++shard) {
+            if (*shard == owner) {
+                continue;
+            }
+            int res = shards[*shard]->rmdir(path);
+            if (res != 0 && res != -ENOENT) {
+                status = res;
+            }
+        }
+        return status;
+    }
+
+    int mkdir( const string& path, uint32_t mode ) {
+        size_t shard;
+        if (lookupMount(path, shard)) {
+            return shards[shard]->mkdir(path, mode);
+        }
+        size_t owner = shardFor(path);
+        int status = shards[owner]->mkdir(path, mode);
+        if (status != 0 && status != -EEXIST) {
+            return status;
+        }
+        // Even if the owner already has it, a previous mkdir may have failed
+        // part way, so make sure every shard has a copy
+        for (size_t i = 0; i < shards.size(); ++i) {
+            if (i == owner) {
+                continue;
+            }
+            int res = shards[i]->mkdir(path, mode);
+            if (res != 0 && res != -EEXIST) {
+                status = res;
+            }
+        }
+        return status;
+    }
+
+    int create( const string& path, uint32_t mode, int32_t flags, uint64_t& fh ) {
+        size_t shard = shardFor(path);
+        int status = shards[shard]->create(path, mode, flags, fh);
+        if (status == 0) {
+            fh = encodeHandle(shard, fh);
+        }
+        return status;
+    }
+
+    int open( const string& path, int32_t flags, uint64_t& fileHandle ) {
+        size_t shard = shardFor(path);
+        int status = shards[shard]->open(path, flags, fileHandle);
+        if (status == 0) {
+            fileHandle = encodeHandle(shard, fileHandle);
+        }
+        return status;
+    }
+
+    int read( uint64_t fh, uint64_t count, int64_t offset, string& buf ) {
+        return shardOf(fh).read(localHandle(fh), count, offset, buf);
+    }
+
+    int write( uint64_t fh, const string& writeBuf, uint32_t count, int64_t offset ) {
+        return shardOf(fh).write(localHandle(fh), writeBuf, count, offset);
+    }
+
+    int unlink( const string& path ) {
+        return shards[shardFor(path)]->unlink(path);
+    }
+
+    int rename( const string& oldName, const string& newName ) {
+        size_t from = shardFor(oldName), to = shardFor(newName);
+        Stat stat;
+        int status = shards[from]->getAttr(oldName, &stat);
+        if (status != 0) {
+            return status;
+        }
+        if (S_ISDIR(stat.mode())) {
+            size_t fromMount, toMount;
+            bool inMount = lookupMount(oldName, fromMount) && lookupMount(newName, toMount);
+            if (inMount && fromMount == toMount) {
+                return shards[from]->rename(oldName, newName);
+            }
+            if (shards.size() > 1) {
+                // Renaming a hashed directory would rehash all of its
+                // children; EXDEV makes mv fall back to copy and unlink
+                return -EXDEV;
+            }
+        }
+        if (from == to) {
+            return shards[from]->rename(oldName, newName);
+        }
+        return copyAcross(oldName, from, newName, to);
+    }
+
+    int utimens( const string& path, uint64_t accessedSec, uint64_t accessedNano, uint64_t modifiedSec, uint64_t modifiedNano ) {
+        return shards[shardFor(path)]->utimens(path, accessedSec, accessedNano, modifiedSec, modifiedNano);
+    }
+
+    int commitWrite( uint64_t fh ) {
+        return shardOf(fh).commitWrite(localHandle(fh));
+    }
+
+    int release( uint64_t fh ) {
+        return shardOf(fh).release(localHandle(fh));
+    }
+};
+
+shared_ptr<ShardedNFSClient> nfsClient;
 
 
 /*=======================================================
@@ -389,6 +1389,16 @@ static struct fsOperations : fuse_operations {
 
 =========================================================*/
 
+static bool parseNumber( const string& text, unsigned long& value ) {
+    if (text.empty() || !isdigit(static_cast<unsigned char>(text[0]))) {
+        return false;
+    }
+    char* end;
+    errno = 0;
+    value = strtoul(text.c_str(), &end, 10);
+    return errno == 0 && *end == '\0';
+}
+
 int main(int argc, char** argv) {
 
     // Parse the arg for the address to the remote filesystem, and the
@@ -398,8 +1408,12 @@ int main(int argc, char** argv) {
     fuse_opt_add_arg(&args, "-f"); // Run client in the foreground, to prevent a weird gRPC race condition
     string remoteMount, localMount, port = "8080";
     string remoteAddress, remoteDir;
+    vector<string> extraShards;
+    map<size_t, vector<string>> replicas;
+    map<string, size_t> mountTable;
+    int deadlineMs = 5000;
     int c;
-    while ((c = getopt(argc, argv, "r:l:p:")) != -1) {
+    while ((c = getopt(argc, argv, "r:l:p:s:m:R:t:")) != -1) {
         switch (c) {
             case 'r':
                 remoteMount.assign(optarg);
@@ -411,6 +1425,45 @@ int main(int argc, char** argv) {
             case 'p':
                 port.assign(optarg);
                 break;
+            case 's':
+                extraShards.push_back(optarg);
+                break;
+            case 'm': {
+                // subtree=shard_index, e.g. -m /home=1
+                string entry(optarg);
+                size_t eq = entry.find('=');
+                unsigned long shard;
+                if (eq == string::npos || eq == 0 || entry[0] != '/' ||
+                    !parseNumber(entry.substr(eq + 1), shard)) {
+                    cerr << "bad mount table entry: " << entry << endl;
+                    return 1;
+                }
+                mountTable[entry.substr(0, eq)] = shard;
+                break;
+            }
+            case 'R': {
+                // shard_index=replica_address:port, e.g. -R 0=otherhost:8080
+                string entry(optarg);
+                size_t eq = entry.find('=');
+                unsigned long shard;
+                if (eq == string::npos || eq + 1 == entry.size() ||
+                    !parseNumber(entry.substr(0, eq), shard)) {
+                    cerr << "bad replica entry: " << entry << endl;
+                    return 1;
+                }
+                replicas[shard].push_back(entry.substr(eq + 1));
+                break;
+            }
+            case 't': {
+                // per-RPC deadline in milliseconds, 0 disables it
+                unsigned long value;
+                if (!parseNumber(optarg, value) || value > INT_MAX) {
+                    cerr << "bad deadline: " << optarg << endl;
+                    return 1;
+                }
+                deadlineMs = value;
+                break;
+            }
         }
     }
 
@@ -421,15 +1474,40 @@ int main(int argc, char** argv) {
     if ( remoteMount.size() == 0 || localMount.size() == 0 ||
          !(ss >> remoteAddress && ss >> remoteDir) ) {
         cout << remoteAddress << "    " << remoteDir;
-        cerr << "usage: " << argv[0] << " -r remote_address:remote_dir [-p port] -l local_mountpoint\n";
+        cerr << "usage: " << argv[0] << " -r remote_address:remote_dir [-p port] [-s shard_address:port]... [-m /subtree=shard]... [-R shard=replica_address:port]... [-t deadline_ms] -l local_mountpoint\n";
         return 1;
     }
 
     remoteAddress += ":" + port;
-    cout << "Mounting to " << remoteDir << " at " << remoteAddress << endl;
+    vector<string> endpoints(1, remoteAddress);
+    endpoints.insert(endpoints.end(), extraShards.begin(), extraShards.end());
+    for (auto it = mountTable.begin(); it != mountTable.end(); ++it) {
+        if (it->second >= endpoints.size()) {
+            cerr << "mount table entry " << it->first << " names missing shard " << it->second << endl;
+            return 1;
+        }
+    }
+    for (auto it = replicas.begin(); it != replicas.end(); ++it) {
+        if (it->first >= endpoints.size()) {
+            cerr << "replica entry names missing shard " << it->first << endl;
+            return 1;
+        }
+    }
+    if (!replicas.empty() && deadlineMs == 0) {
+        // Without a deadline a stalled replica would hold a hedged attempt
+        // forever
+        cerr << "replicas need a deadline, -t 0 is not allowed with -R" << endl;
+        return 1;
+    }
+    for (size_t i = 0; i < endpoints.size(); ++i) {
+        cout << "Mounting to " << remoteDir << " at " << endpoints[i] << " (shard " << i << ")" << endl;
+        auto it = replicas.find(i);
+        for (size_t r = 0; it != replicas.end() && r < it->second.size(); ++r) {
+            cout << "    replica at " << it->second[r] << endl;
+        }
+    }
 
-    shared_ptr<Channel> channel = grpc::CreateChannel(remoteAddress, grpc::InsecureChannelCredentials());
-    nfsClient.reset(new NFSClient(channel));
+    nfsClient.reset(new ShardedNFSClient(endpoints, replicas, mountTable, deadlineMs));
 
     return fuse_main(args.argc, args.argv, &fsOps, NULL);
 }
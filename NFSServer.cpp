@@ -5,6 +5,7 @@
 #include <dirent.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <grpcpp/grpcpp.h>
 #include "NFS.grpc.pb.h"
 
@@ -107,7 +108,7 @@ class NFSServiceImpl final : public NFS::Service {
             reply->set_err(errno);
         } else {
             reply->set_bytes_read(bytes_read);
-            reply->set_buffer(buf);
+            reply->set_buffer(buf, bytes_read);
             reply->set_err(0);
         }
         delete[] buf;
@@ -238,20 +239,36 @@ class NFSServiceImpl final : public NFS::Service {
     }
 };
 
-void RunServer() {
-    string server_address("127.0.0.1:8080");
+void RunServer(const string& server_address) {
     NFSServiceImpl service;
 
     ServerBuilder builder;
     builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
     builder.RegisterService(&service);
     unique_ptr<Server> server(builder.BuildAndStart());
-    cout << "Server listening on " << server_address << endl;
+    cout << "Server listening on " << server_address << ", exporting " << serverMount << endl;
 
     server->Wait();
 }
 
-int main() {
-    RunServer();
+int main(int argc, char** argv) {
+    // Each shard of a sharded mount is its own server process, so the port
+    // and the exported directory must be configurable per process
+    string port = "8080";
+    int c;
+    while ((c = getopt(argc, argv, "p:d:")) != -1) {
+        switch (c) {
+            case 'p':
+                port.assign(optarg);
+                break;
+            case 'd':
+                serverMount.assign(optarg);
+                break;
+            default:
+                cerr << "usage: " << argv[0] << " [-p port] [-d export_dir]\n";
+                return 1;
+        }
+    }
+    RunServer("127.0.0.1:" + port);
     return 0;
 }